@@ -17,6 +17,7 @@ XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX
 #endif
 
 #include "gentree.h"
+#include "jitstd/algorithm.h"
 
 //------------------------------------------------------------------------
 // DoPhase: Run analysis (if object stack allocation is enabled) and then
@@ -55,54 +56,28 @@ void ObjectAllocator::DoPhase()
 }
 
 //------------------------------------------------------------------------------
-// MarkLclVarAsEscaping : Mark local variable as escaping.
-//
+// MapHeapLocalToStackLocal : Record the stack local created for a stack-allocated
+//                            heap local.
 //
 // Arguments:
-//    lclNum  - Escaping pointing local variable number
+//    lclNum       - Local variable number of the heap local
+//    stackLclNum  - Local variable number of the stack local
 
-void ObjectAllocator::MarkLclVarAsEscaping(unsigned int lclNum)
+void ObjectAllocator::MapHeapLocalToStackLocal(unsigned int lclNum, unsigned int stackLclNum)
 {
-    BitVecOps::AddElemD(&m_bitVecTraits, m_EscapingPointers, lclNum);
-}
-
-//------------------------------------------------------------------------------
-// MarkLclVarAsPossiblyStackPointing : Mark local variable as possibly pointing
-//                                     to a stack-allocated object.
-//
-//
-// Arguments:
-//    lclNum  - Possibly stack-object-pointing local variable number
-
-void ObjectAllocator::MarkLclVarAsPossiblyStackPointing(unsigned int lclNum)
-{
-    BitVecOps::AddElemD(&m_bitVecTraits, m_PossiblyStackPointingPointers, lclNum);
-}
-
-//------------------------------------------------------------------------------
-// MarkLclVarAsDefinitelyStackPointing : Mark local variable as definitely pointing
-//                                       to a stack-allocated object.
-//
-//
-// Arguments:
-//    lclNum  - Definitely stack-object-pointing local variable number
-
-void ObjectAllocator::MarkLclVarAsDefinitelyStackPointing(unsigned int lclNum)
-{
-    BitVecOps::AddElemD(&m_bitVecTraits, m_DefinitelyStackPointingPointers, lclNum);
-}
+    if (m_HeapLocalToStackLocalMap == nullptr)
+    {
+        m_HeapLocalToStackLocalMap = new (comp->getAllocator(CMK_ObjectAllocator)) unsigned int[m_RefLocalCount];
 
-//------------------------------------------------------------------------------
-// AddConnGraphEdge : Record that the source local variable may point to the same set of objects
-//                    as the set pointed to by target local variable.
-//
-// Arguments:
-//    sourceLclNum  - Local variable number of the edge source
-//    targetLclNum  - Local variable number of the edge target
+        for (unsigned int refId = 0; refId < m_RefLocalCount; ++refId)
+        {
+            m_HeapLocalToStackLocalMap[refId] = BAD_VAR_NUM;
+        }
+    }
 
-void ObjectAllocator::AddConnGraphEdge(unsigned int sourceLclNum, unsigned int targetLclNum)
-{
-    BitVecOps::AddElemD(&m_bitVecTraits, m_ConnGraphAdjacencyMatrix[sourceLclNum], targetLclNum);
+    const unsigned int refId = GetRefLocalId(lclNum);
+    assert(refId != BAD_VAR_NUM);
+    m_HeapLocalToStackLocalMap[refId] = stackLclNum;
 }
 
 //------------------------------------------------------------------------
@@ -116,9 +91,6 @@ void ObjectAllocator::DoAnalysis()
 
     if (comp->lvaCount > 0)
     {
-        m_EscapingPointers         = BitVecOps::MakeEmpty(&m_bitVecTraits);
-        m_ConnGraphAdjacencyMatrix = new (comp->getAllocator(CMK_ObjectAllocator)) BitSetShortLongRep[comp->lvaCount];
-
         MarkEscapingVarsAndBuildConnGraph();
         ComputeEscapingNodes(&m_bitVecTraits, m_EscapingPointers);
     }
@@ -167,56 +139,180 @@ void ObjectAllocator::MarkEscapingVarsAndBuildConnGraph()
             assert(tree != nullptr);
             assert(tree->IsLocal());
 
-            var_types type = tree->TypeGet();
-            if ((tree->OperGet() == GT_LCL_VAR) && (type == TYP_REF || type == TYP_BYREF || type == TYP_I_IMPL))
+            if ((tree->OperGet() == GT_LCL_VAR) && MayPointToObjects(tree->TypeGet()))
             {
                 unsigned int lclNum = tree->AsLclVar()->GetLclNum();
                 assert(tree == m_ancestors.Top());
 
-                if (m_allocator->CanLclVarEscapeViaParentStack(&m_ancestors, lclNum))
+                if (user == nullptr)
                 {
-                    if (!m_allocator->CanLclVarEscape(lclNum))
-                    {
-                        JITDUMP("V%02u first escapes via [%06u]\n", lclNum, m_compiler->dspTreeID(tree));
-                    }
-                    m_allocator->MarkLclVarAsEscaping(lclNum);
+                    // The local is the whole statement; it doesn't escape.
+                    return Compiler::fgWalkResult::WALK_CONTINUE;
+                }
+
+                bool canEscape;
+
+                // Dispatch the parents that are decisive on their own here, where
+                // the parent node has already been fetched; this skips the full
+                // parent stack walk for the most common shapes.
+                switch (user->OperGet())
+                {
+                    case GT_EQ:
+                    case GT_NE:
+                        return Compiler::fgWalkResult::WALK_CONTINUE;
+
+                    case GT_ASG:
+                        if (user->AsOp()->gtGetOp1() == tree)
+                        {
+                            // Assigning to a local doesn't make it escaping.
+                            return Compiler::fgWalkResult::WALK_CONTINUE;
+                        }
+                        canEscape = m_allocator->CanLclVarEscapeViaParentStack(&m_ancestors, lclNum);
+                        break;
+
+                    case GT_CALL:
+                        // All call arguments currently escape, whether the callee is
+                        // a helper or not (see the GT_CALL case in
+                        // CanLclVarEscapeViaParentStack), so there are no per-call
+                        // properties to look up and no need to walk the parent stack.
+                        canEscape = true;
+                        break;
+
+                    case GT_RETURN:
+                        // Returning the local makes it visible to the caller.
+                        canEscape = true;
+                        break;
+
+                    default:
+                        canEscape = m_allocator->CanLclVarEscapeViaParentStack(&m_ancestors, lclNum);
+                        break;
+                }
+
+                if (canEscape && m_allocator->MarkLclVarAsEscaping(lclNum))
+                {
+                    JITDUMP("V%02u first escapes via [%06u]\n", lclNum, m_compiler->dspTreeID(tree));
                 }
             }
             return Compiler::fgWalkResult::WALK_CONTINUE;
         }
     };
 
-    for (unsigned int lclNum = 0; lclNum < comp->lvaCount; ++lclNum)
+    CompAllocator allocator = comp->getAllocator(CMK_ObjectAllocator);
+
+    // Assign compact ref-local ids to the locals that may point to objects so that
+    // the bit vectors and the connection graph are sized by the number of such
+    // locals instead of lvaCount.
+    m_AnalysisLclCount = comp->lvaCount;
+    m_LclNumToRefIdMap = new (allocator) unsigned int[m_AnalysisLclCount];
+    m_RefLocalCount    = 0;
+
+    for (unsigned int lclNum = 0; lclNum < m_AnalysisLclCount; ++lclNum)
     {
-        var_types type = comp->lvaTable[lclNum].TypeGet();
+        if (MayPointToObjects(comp->lvaTable[lclNum].TypeGet()))
+        {
+            m_LclNumToRefIdMap[lclNum] = m_RefLocalCount++;
+        }
+        else
+        {
+            // Variable that may not point to objects will not participate in our analysis.
+            m_LclNumToRefIdMap[lclNum] = BAD_VAR_NUM;
+        }
+    }
+
+    m_RefIdToLclNumMap = new (allocator) unsigned int[m_RefLocalCount];
 
-        if (type == TYP_REF || genActualType(type) == TYP_I_IMPL || type == TYP_BYREF)
+    for (unsigned int lclNum = 0; lclNum < m_AnalysisLclCount; ++lclNum)
+    {
+        if (m_LclNumToRefIdMap[lclNum] != BAD_VAR_NUM)
         {
-            m_ConnGraphAdjacencyMatrix[lclNum] = BitVecOps::MakeEmpty(&m_bitVecTraits);
+            m_RefIdToLclNumMap[m_LclNumToRefIdMap[lclNum]] = lclNum;
+        }
+    }
 
-            if (comp->lvaTable[lclNum].lvAddrExposed)
-            {
-                JITDUMP("   V%02u is address exposed\n", lclNum);
-                MarkLclVarAsEscaping(lclNum);
-            }
+    // Size the bit vectors by the number of ref-locals. With BITS_PER_SIZE_T or
+    // fewer ref-locals BitVecOps uses BitSetShortLong's short form, which keeps
+    // each set inline in a single machine word, so all the set algebra below is
+    // plain integer ops with no heap allocation.
+    m_bitVecTraits     = BitVecTraits(m_RefLocalCount, comp);
+    m_EscapingPointers = BitVecOps::MakeEmpty(&m_bitVecTraits);
+    m_ConnGraphEdges   = new (allocator) ConnGraphEdgeVector(allocator);
+
+    unsigned int nonEscapedRefLocals = 0;
+
+    for (unsigned int refId = 0; refId < m_RefLocalCount; ++refId)
+    {
+        const unsigned int lclNum = m_RefIdToLclNumMap[refId];
+
+        if (comp->lvaTable[lclNum].lvAddrExposed)
+        {
+            JITDUMP("   V%02u is address exposed\n", lclNum);
+            MarkLclVarAsEscaping(lclNum);
         }
         else
         {
-            // Variable that may not point to objects will not participate in our analysis.
-            m_ConnGraphAdjacencyMatrix[lclNum] = BitVecOps::UninitVal();
+            ++nonEscapedRefLocals;
         }
     }
 
-    BasicBlock* block;
+    // If there are no ref-locals or all of them are already escaping, connectivity
+    // cannot change the analysis result so skip the IR walk entirely.
+    if (nonEscapedRefLocals > 0)
+    {
+        // While walking the statements anyway, record the blocks that contain a
+        // canonical GT_ALLOCOBJ assignment so that MorphAllocObjNodes doesn't have
+        // to walk the other blocks again.
+        m_AllocObjBlocks = new (allocator) BasicBlockVector(allocator);
 
-    foreach_block(comp, block)
+        BasicBlock* block;
+
+        foreach_block(comp, block)
+        {
+            bool blockHasAllocObj = false;
+
+            for (Statement* stmt : block->Statements())
+            {
+                GenTree* stmtExpr = stmt->GetRootNode();
+
+                if (!blockHasAllocObj && (stmtExpr->OperGet() == GT_ASG) && (stmtExpr->TypeGet() == TYP_REF) &&
+                    (stmtExpr->gtGetOp2()->OperGet() == GT_ALLOCOBJ))
+                {
+                    blockHasAllocObj = true;
+                }
+
+                BuildConnGraphVisitor buildConnGraphVisitor(this);
+                buildConnGraphVisitor.WalkTree(stmt->GetRootNodePointer(), nullptr);
+            }
+
+            if (blockHasAllocObj)
+            {
+                assert((block->bbFlags & BBF_HAS_NEWOBJ) != 0);
+                m_AllocObjBlocks->push_back(block);
+            }
+        }
+    }
+    else
     {
-        for (Statement* stmt : block->Statements())
+        JITDUMP("   no non-escaping ref-locals, skipping the tree walk\n");
+    }
+
+    // Sort the edges by their source so that the edges of each ref-local form a
+    // contiguous span and record where each span starts.
+    jitstd::sort(m_ConnGraphEdges->begin(), m_ConnGraphEdges->end(),
+                 [](const ConnGraphEdge& e1, const ConnGraphEdge& e2) { return e1.m_SourceRefId < e2.m_SourceRefId; });
+
+    const unsigned int edgeCount = (unsigned int)m_ConnGraphEdges->size();
+    m_ConnGraphEdgeStarts        = new (allocator) unsigned int[m_RefLocalCount + 1];
+
+    unsigned int edgeIndex = 0;
+    for (unsigned int refId = 0; refId < m_RefLocalCount; ++refId)
+    {
+        m_ConnGraphEdgeStarts[refId] = edgeIndex;
+        while ((edgeIndex < edgeCount) && ((*m_ConnGraphEdges)[edgeIndex].m_SourceRefId == refId))
         {
-            BuildConnGraphVisitor buildConnGraphVisitor(this);
-            buildConnGraphVisitor.WalkTree(stmt->GetRootNodePointer(), nullptr);
+            ++edgeIndex;
         }
     }
+    m_ConnGraphEdgeStarts[m_RefLocalCount] = edgeCount;
 }
 
 //------------------------------------------------------------------------------
@@ -229,33 +325,33 @@ void ObjectAllocator::MarkEscapingVarsAndBuildConnGraph()
 
 void ObjectAllocator::ComputeEscapingNodes(BitVecTraits* bitVecTraits, BitVec& escapingNodes)
 {
-    BitSetShortLongRep escapingNodesToProcess = BitVecOps::MakeCopy(bitVecTraits, escapingNodes);
-    BitSetShortLongRep newEscapingNodes       = BitVecOps::UninitVal();
+    ArrayStack<unsigned int> worklist(comp->getAllocator(CMK_ObjectAllocator));
 
-    unsigned int lclNum;
+    // Seed the worklist with the initially-escaping ref-locals.
+    BitVecOps::Iter iterator(bitVecTraits, escapingNodes);
+    unsigned int    refId;
+
+    while (iterator.NextElem(&refId))
+    {
+        worklist.Push(refId);
+    }
 
-    bool doOneMoreIteration = true;
-    while (doOneMoreIteration)
+    // Each ref-local is processed once after it has been marked escaping: every
+    // target in its edge span escapes as well and is queued when newly marked.
+    while (!worklist.Empty())
     {
-        BitVecOps::Iter iterator(bitVecTraits, escapingNodesToProcess);
-        doOneMoreIteration = false;
+        refId = worklist.Pop();
 
-        while (iterator.NextElem(&lclNum))
+        const unsigned int firstEdge = m_ConnGraphEdgeStarts[refId];
+        const unsigned int lastEdge  = m_ConnGraphEdgeStarts[refId + 1];
+
+        for (unsigned int edgeIndex = firstEdge; edgeIndex < lastEdge; ++edgeIndex)
         {
-            if (m_ConnGraphAdjacencyMatrix[lclNum] != nullptr)
+            const unsigned int targetRefId = (*m_ConnGraphEdges)[edgeIndex].m_TargetRefId;
+
+            if (BitVecOps::TryAddElemD(bitVecTraits, escapingNodes, targetRefId))
             {
-                doOneMoreIteration = true;
-
-                // newEscapingNodes         = adjacentNodes[lclNum]
-                BitVecOps::Assign(bitVecTraits, newEscapingNodes, m_ConnGraphAdjacencyMatrix[lclNum]);
-                // newEscapingNodes         = newEscapingNodes \ escapingNodes
-                BitVecOps::DiffD(bitVecTraits, newEscapingNodes, escapingNodes);
-                // escapingNodesToProcess   = escapingNodesToProcess U newEscapingNodes
-                BitVecOps::UnionD(bitVecTraits, escapingNodesToProcess, newEscapingNodes);
-                // escapingNodes = escapingNodes U newEscapingNodes
-                BitVecOps::UnionD(bitVecTraits, escapingNodes, newEscapingNodes);
-                // escapingNodesToProcess   = escapingNodesToProcess \ { lclNum }
-                BitVecOps::RemoveElemD(bitVecTraits, escapingNodesToProcess, lclNum);
+                worklist.Push(targetRefId);
             }
         }
     }
@@ -277,42 +373,55 @@ void ObjectAllocator::ComputeStackObjectPointers(BitVecTraits* bitVecTraits)
     while (changed)
     {
         changed = false;
-        for (unsigned int lclNum = 0; lclNum < comp->lvaCount; ++lclNum)
+        for (unsigned int refId = 0; refId < m_RefLocalCount; ++refId)
         {
-            LclVarDsc* lclVarDsc = comp->lvaTable + lclNum;
-            var_types  type      = lclVarDsc->TypeGet();
+            if (BitVecOps::IsMember(bitVecTraits, m_PossiblyStackPointingPointers, refId))
+            {
+                continue;
+            }
+
+            const unsigned int lclNum    = m_RefIdToLclNumMap[refId];
+            LclVarDsc*         lclVarDsc = comp->lvaTable + lclNum;
 
-            if (type == TYP_REF || type == TYP_I_IMPL || type == TYP_BYREF)
+            // Check if the local may point to the same objects as a possibly-stack-pointing local.
+            const unsigned int firstEdge       = m_ConnGraphEdgeStarts[refId];
+            const unsigned int lastEdge        = m_ConnGraphEdgeStarts[refId + 1];
+            bool               mayPointToStack = false;
+
+            for (unsigned int edgeIndex = firstEdge; edgeIndex < lastEdge; ++edgeIndex)
             {
-                if (!MayLclVarPointToStack(lclNum) &&
-                    !BitVecOps::IsEmptyIntersection(bitVecTraits, m_PossiblyStackPointingPointers,
-                                                    m_ConnGraphAdjacencyMatrix[lclNum]))
+                const ConnGraphEdge& edge = (*m_ConnGraphEdges)[edgeIndex];
+                if (BitVecOps::IsMember(bitVecTraits, m_PossiblyStackPointingPointers, edge.m_TargetRefId))
                 {
-                    // We discovered a new pointer that may point to the stack.
-                    MarkLclVarAsPossiblyStackPointing(lclNum);
+                    mayPointToStack = true;
+                    break;
+                }
+            }
+
+            if (mayPointToStack)
+            {
+                // We discovered a new pointer that may point to the stack.
+                MarkLclVarAsPossiblyStackPointing(lclNum);
 
-                    // Check if this pointer always points to the stack.
-                    if (lclVarDsc->lvSingleDef == 1)
+                // Check if this pointer always points to the stack.
+                if (lclVarDsc->lvSingleDef == 1)
+                {
+                    // Check if we know what is assigned to this pointer.
+                    const unsigned int targetCount = lastEdge - firstEdge;
+                    assert(targetCount <= 1);
+                    if (targetCount == 1)
                     {
-                        // Check if we know what is assigned to this pointer.
-                        unsigned bitCount = BitVecOps::Count(bitVecTraits, m_ConnGraphAdjacencyMatrix[lclNum]);
-                        assert(bitCount <= 1);
-                        if (bitCount == 1)
+                        const unsigned int rhsLclNum = m_RefIdToLclNumMap[(*m_ConnGraphEdges)[firstEdge].m_TargetRefId];
+
+                        if (DoesLclVarPointToStack(rhsLclNum))
                         {
-                            BitVecOps::Iter iter(bitVecTraits, m_ConnGraphAdjacencyMatrix[lclNum]);
-                            unsigned        rhsLclNum = 0;
-                            iter.NextElem(&rhsLclNum);
-
-                            if (DoesLclVarPointToStack(rhsLclNum))
-                            {
-                                // The only assignment to lclNum local is definitely-stack-pointing
-                                // rhsLclNum local so lclNum local is also definitely-stack-pointing.
-                                MarkLclVarAsDefinitelyStackPointing(lclNum);
-                            }
+                            // The only assignment to lclNum local is definitely-stack-pointing
+                            // rhsLclNum local so lclNum local is also definitely-stack-pointing.
+                            MarkLclVarAsDefinitelyStackPointing(lclNum);
                         }
                     }
-                    changed = true;
                 }
+                changed = true;
             }
         }
     }
@@ -330,103 +439,165 @@ void ObjectAllocator::ComputeStackObjectPointers(BitVecTraits* bitVecTraits)
 
 bool ObjectAllocator::MorphAllocObjNodes()
 {
-    bool didStackAllocate             = false;
-    m_PossiblyStackPointingPointers   = BitVecOps::MakeEmpty(&m_bitVecTraits);
-    m_DefinitelyStackPointingPointers = BitVecOps::MakeEmpty(&m_bitVecTraits);
+    bool didStackAllocate = false;
 
-    BasicBlock* block;
+    // The stack-pointer sets are only consulted after something was stack
+    // allocated, which requires stack allocation to be enabled.
+    const bool isStackAllocationEnabled = IsObjectStackAllocationEnabled();
 
-    foreach_block(comp, block)
+    if (isStackAllocationEnabled)
     {
-        const bool basicBlockHasNewObj       = (block->bbFlags & BBF_HAS_NEWOBJ) == BBF_HAS_NEWOBJ;
-        const bool basicBlockHasBackwardJump = (block->bbFlags & BBF_BACKWARD_JUMP) == BBF_BACKWARD_JUMP;
-#ifndef DEBUG
-        if (!basicBlockHasNewObj)
+        m_PossiblyStackPointingPointers   = BitVecOps::MakeEmpty(&m_bitVecTraits);
+        m_DefinitelyStackPointingPointers = BitVecOps::MakeEmpty(&m_bitVecTraits);
+    }
+
+#ifdef DEBUG
+    // Verifying that no GT_ALLOCOBJ lurks outside the canonical form walks every
+    // tree in the method, so only pay for it on stress runs.
+    const bool assertOnUnexpectedAllocObj = (JitConfig.JitStress() > 0);
+    // On stress runs visit every block so the no-stray-allocobj assert keeps its
+    // full coverage.
+    const bool visitAllBlocks = (m_AllocObjBlocks == nullptr) || assertOnUnexpectedAllocObj;
+#else
+    const bool visitAllBlocks = (m_AllocObjBlocks == nullptr);
+#endif // DEBUG
+
+    if (visitAllBlocks)
+    {
+        BasicBlock* block;
+
+        foreach_block(comp, block)
         {
-            continue;
-        }
+            // Skip blocks that cannot contain a canonical GT_ALLOCOBJ assignment.
+            bool canSkipBlock = (block->bbFlags & BBF_HAS_NEWOBJ) == 0;
+#ifdef DEBUG
+            canSkipBlock = canSkipBlock && !assertOnUnexpectedAllocObj;
 #endif // DEBUG
+            if (canSkipBlock)
+            {
+                continue;
+            }
 
-        for (Statement* stmt : block->Statements())
+            didStackAllocate |=
+                MorphAllocObjNodesInBlock(block, isStackAllocationEnabled DEBUGARG(assertOnUnexpectedAllocObj));
+        }
+    }
+    else
+    {
+        // The analysis walk recorded exactly which blocks contain a canonical
+        // GT_ALLOCOBJ assignment; visit just those.
+        for (BasicBlock* block : *m_AllocObjBlocks)
         {
-            GenTree* stmtExpr = stmt->GetRootNode();
-            GenTree* op2      = nullptr;
+            didStackAllocate |=
+                MorphAllocObjNodesInBlock(block, isStackAllocationEnabled DEBUGARG(assertOnUnexpectedAllocObj));
+        }
+    }
+
+    return didStackAllocate;
+}
 
-            bool canonicalAllocObjFound = false;
+//------------------------------------------------------------------------
+// MorphAllocObjNodesInBlock: Morph each GT_ALLOCOBJ node of a basic block
+//                            either into an allocation helper call or stack
+//                            allocation.
+//
+// Arguments:
+//    block                      - The basic block to morph
+//    isStackAllocationEnabled   - Whether object stack allocation is enabled
+//    assertOnUnexpectedAllocObj - Whether to check that statements without a
+//                                 canonical GT_ALLOCOBJ assignment at the root
+//                                 contain no GT_ALLOCOBJ at all
+//
+// Returns:
+//    true if any allocation was done as a stack allocation.
 
-            if (stmtExpr->OperGet() == GT_ASG && stmtExpr->TypeGet() == TYP_REF)
-            {
-                op2 = stmtExpr->gtGetOp2();
+bool ObjectAllocator::MorphAllocObjNodesInBlock(BasicBlock* block,
+                                                bool isStackAllocationEnabled DEBUGARG(bool assertOnUnexpectedAllocObj))
+{
+    bool didStackAllocate = false;
 
-                if (op2->OperGet() == GT_ALLOCOBJ)
-                {
-                    canonicalAllocObjFound = true;
-                }
+    const bool basicBlockHasBackwardJump = (block->bbFlags & BBF_BACKWARD_JUMP) == BBF_BACKWARD_JUMP;
+
+    for (Statement* stmt : block->Statements())
+    {
+        GenTree* stmtExpr = stmt->GetRootNode();
+        GenTree* op2      = nullptr;
+
+        bool canonicalAllocObjFound = false;
+
+        if (stmtExpr->OperGet() == GT_ASG && stmtExpr->TypeGet() == TYP_REF)
+        {
+            op2 = stmtExpr->gtGetOp2();
+
+            if (op2->OperGet() == GT_ALLOCOBJ)
+            {
+                canonicalAllocObjFound = true;
             }
+        }
 
-            if (canonicalAllocObjFound)
+        if (canonicalAllocObjFound)
+        {
+            assert((block->bbFlags & BBF_HAS_NEWOBJ) != 0);
+            //------------------------------------------------------------------------
+            // We expect the following expression tree at this point
+            //  STMTx (IL 0x... ???)
+            //    * ASG       ref
+            //    +--*  LCL_VAR   ref
+            //    \--*  ALLOCOBJ  ref
+            //       \--*  CNS_INT(h) long
+            //------------------------------------------------------------------------
+
+            GenTree* op1 = stmtExpr->gtGetOp1();
+
+            assert(op1->OperGet() == GT_LCL_VAR);
+            assert(op1->TypeGet() == TYP_REF);
+            assert(op2 != nullptr);
+            assert(op2->OperGet() == GT_ALLOCOBJ);
+
+            GenTreeAllocObj*     asAllocObj = op2->AsAllocObj();
+            unsigned int         lclNum     = op1->AsLclVar()->GetLclNum();
+            CORINFO_CLASS_HANDLE clsHnd     = op2->AsAllocObj()->gtAllocObjClsHnd;
+
+            // Don't attempt to do stack allocations inside basic blocks that may be in a loop.
+            if (isStackAllocationEnabled && !basicBlockHasBackwardJump && CanAllocateLclVarOnStack(lclNum, clsHnd))
             {
-                assert(basicBlockHasNewObj);
-                //------------------------------------------------------------------------
-                // We expect the following expression tree at this point
-                //  STMTx (IL 0x... ???)
-                //    * ASG       ref
-                //    +--*  LCL_VAR   ref
-                //    \--*  ALLOCOBJ  ref
-                //       \--*  CNS_INT(h) long
-                //------------------------------------------------------------------------
-
-                GenTree* op1 = stmtExpr->gtGetOp1();
-
-                assert(op1->OperGet() == GT_LCL_VAR);
-                assert(op1->TypeGet() == TYP_REF);
-                assert(op2 != nullptr);
-                assert(op2->OperGet() == GT_ALLOCOBJ);
-
-                GenTreeAllocObj*     asAllocObj = op2->AsAllocObj();
-                unsigned int         lclNum     = op1->AsLclVar()->GetLclNum();
-                CORINFO_CLASS_HANDLE clsHnd     = op2->AsAllocObj()->gtAllocObjClsHnd;
-
-                // Don't attempt to do stack allocations inside basic blocks that may be in a loop.
-                if (IsObjectStackAllocationEnabled() && !basicBlockHasBackwardJump &&
-                    CanAllocateLclVarOnStack(lclNum, clsHnd))
+                JITDUMP("Allocating local variable V%02u on the stack\n", lclNum);
+
+                const unsigned int stackLclNum = MorphAllocObjNodeIntoStackAlloc(asAllocObj, block, stmt);
+                MapHeapLocalToStackLocal(lclNum, stackLclNum);
+                // We keep the set of possibly-stack-pointing pointers as a superset of the set of
+                // definitely-stack-pointing pointers. All definitely-stack-pointing pointers are in both sets.
+                MarkLclVarAsDefinitelyStackPointing(lclNum);
+                MarkLclVarAsPossiblyStackPointing(lclNum);
+                // The operands of the root assignment were repurposed for the new
+                // statements, so don't reattach op2 to the NOP below.
+                stmt->GetRootNode()->gtBashToNOP();
+                comp->optMethodFlags |= OMF_HAS_OBJSTACKALLOC;
+                didStackAllocate = true;
+            }
+            else
+            {
+                if (isStackAllocationEnabled)
                 {
-                    JITDUMP("Allocating local variable V%02u on the stack\n", lclNum);
-
-                    const unsigned int stackLclNum = MorphAllocObjNodeIntoStackAlloc(asAllocObj, block, stmt);
-                    m_HeapLocalToStackLocalMap.AddOrUpdate(lclNum, stackLclNum);
-                    // We keep the set of possibly-stack-pointing pointers as a superset of the set of
-                    // definitely-stack-pointing pointers. All definitely-stack-pointing pointers are in both sets.
-                    MarkLclVarAsDefinitelyStackPointing(lclNum);
-                    MarkLclVarAsPossiblyStackPointing(lclNum);
-                    stmt->GetRootNode()->gtBashToNOP();
-                    comp->optMethodFlags |= OMF_HAS_OBJSTACKALLOC;
-                    didStackAllocate = true;
+                    JITDUMP("Allocating local variable V%02u on the heap\n", lclNum);
                 }
-                else
-                {
-                    if (IsObjectStackAllocationEnabled())
-                    {
-                        JITDUMP("Allocating local variable V%02u on the heap\n", lclNum);
-                    }
 
-                    op2 = MorphAllocObjNodeIntoHelperCall(asAllocObj);
-                }
+                op2 = MorphAllocObjNodeIntoHelperCall(asAllocObj);
 
                 // Propagate flags of op2 to its parent.
                 stmtExpr->AsOp()->gtOp2 = op2;
                 stmtExpr->gtFlags |= op2->gtFlags & GTF_ALL_EFFECT;
             }
+        }
 
 #ifdef DEBUG
-            else
-            {
-                // We assume that GT_ALLOCOBJ nodes are always present in the
-                // canonical form.
-                comp->fgWalkTreePre(stmt->GetRootNodePointer(), AssertWhenAllocObjFoundVisitor);
-            }
-#endif // DEBUG
+        else if (assertOnUnexpectedAllocObj)
+        {
+            // We assume that GT_ALLOCOBJ nodes are always present in the
+            // canonical form.
+            comp->fgWalkTreePre(stmt->GetRootNodePointer(), AssertWhenAllocObjFoundVisitor);
         }
+#endif // DEBUG
     }
 
     return didStackAllocate;
@@ -510,10 +681,12 @@ unsigned int ObjectAllocator::MorphAllocObjNodeIntoStackAlloc(GenTreeAllocObj* a
     const int unsafeValueClsCheck = true;
     comp->lvaSetStruct(lclNum, allocObj->gtAllocObjClsHnd, unsafeValueClsCheck);
 
+    LclVarDsc* const lclVarDsc = comp->lvaTable + lclNum;
+
     // Initialize the object memory if necessary
-    if (comp->fgStructTempNeedsExplicitZeroInit(comp->lvaTable + lclNum, block))
+    if (comp->fgStructTempNeedsExplicitZeroInit(lclVarDsc, block))
     {
-        unsigned int structSize = comp->lvaTable[lclNum].lvSize();
+        unsigned int structSize = lclVarDsc->lvSize();
 
         //------------------------------------------------------------------------
         // STMTx (IL 0x... ???)
@@ -541,13 +714,32 @@ unsigned int ObjectAllocator::MorphAllocObjNodeIntoStackAlloc(GenTreeAllocObj* a
     //   \--*  CNS_INT(h) long
     //------------------------------------------------------------------------
 
-    // Create a local representing the object
-    GenTree* tree = comp->gtNewLclvNode(lclNum, TYP_STRUCT);
-
-    // Add a pseudo-field for the method table pointer and initialize it
-    tree = comp->gtNewOperNode(GT_ADDR, TYP_BYREF, tree);
+    // The caller is about to bash the root assignment of stmt to a NOP, which
+    // orphans its destination local node and the GT_ALLOCOBJ node itself;
+    // repurpose both for the method table pseudo-field statement instead of
+    // allocating fresh nodes.
+    GenTree* const stmtExpr          = stmt->GetRootNode();
+    GenTree* const methodTableHandle = allocObj->gtGetOp1();
+
+    assert(stmtExpr->OperGet() == GT_ASG);
+
+    // Turn the assignment destination into a local representing the object.
+    GenTree* tree = stmtExpr->AsOp()->gtGetOp1();
+    assert((tree->OperGet() == GT_LCL_VAR) && (tree->TypeGet() == TYP_REF));
+    tree->AsLclVar()->SetLclNum(lclNum);
+    tree->ChangeType(TYP_STRUCT);
+    tree->gtFlags = 0;
+
+    // Add a pseudo-field for the method table pointer and initialize it. The
+    // GT_ALLOCOBJ node becomes the address node; clear its flags since taking
+    // the address of a local has no effects.
+    allocObj->ChangeOper(GT_ADDR);
+    allocObj->ChangeType(TYP_BYREF);
+    allocObj->AsOp()->gtOp1 = tree;
+    allocObj->gtFlags       = 0;
+    tree                    = allocObj;
     tree = comp->gtNewFieldRef(TYP_I_IMPL, FieldSeqStore::FirstElemPseudoField, tree, 0);
-    tree = comp->gtNewAssignNode(tree, allocObj->gtGetOp1());
+    tree = comp->gtNewAssignNode(tree, methodTableHandle);
 
     Statement* newStmt = comp->gtNewStmt(tree);
 
@@ -579,6 +771,8 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
     bool keepChecking                  = true;
     bool canLclVarEscapeViaParentStack = true;
 
+    GenTree* tree = parentStack->Top(0);
+
     while (keepChecking)
     {
         if (parentStack->Height() <= parentIndex)
@@ -588,7 +782,6 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
         }
 
         canLclVarEscapeViaParentStack = true;
-        GenTree* tree                 = parentStack->Top(parentIndex - 1);
         GenTree* parent               = parentStack->Top(parentIndex);
         keepChecking                  = false;
 
@@ -643,7 +836,7 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
                 break;
 
             case GT_COMMA:
-                if (parent->AsOp()->gtGetOp1() == parentStack->Top(parentIndex - 1))
+                if (parent->AsOp()->gtGetOp1() == tree)
                 {
                     // Left child of GT_COMMA, it will be discarded
                     canLclVarEscapeViaParentStack = false;
@@ -656,6 +849,7 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
                 // Check whether the local escapes via its grandparent.
                 ++parentIndex;
                 keepChecking = true;
+                tree         = parent;
                 break;
 
             case GT_FIELD:
@@ -668,6 +862,7 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
                     // Check if the address of the field/ind escapes.
                     parentIndex += 2;
                     keepChecking = true;
+                    tree         = parentStack->Top(parentIndex - 1);
                 }
                 else
                 {
@@ -693,7 +888,17 @@ bool ObjectAllocator::CanLclVarEscapeViaParentStack(ArrayStack<GenTree*>* parent
                 break;
             }
 
+            case GT_RETURN:
+                // Returning the local makes it visible to the caller.
+                canLclVarEscapeViaParentStack = true;
+                break;
+
             default:
+                // Note that the escape side of the classification is handled
+                // conservatively here: any parent that is not known to keep the
+                // local method-private makes it escape. Stores through an
+                // indirection are covered by the GT_ASG case above since stores
+                // are still in assignment form at this stage.
                 break;
         }
     }
@@ -871,16 +1076,20 @@ void ObjectAllocator::RewriteUses()
             unsigned int       newLclNum = BAD_VAR_NUM;
             LclVarDsc*         lclVarDsc = m_compiler->lvaTable + lclNum;
 
-            if ((lclNum < BitVecTraits::GetSize(&m_allocator->m_bitVecTraits)) &&
-                m_allocator->MayLclVarPointToStack(lclNum))
+            if (m_allocator->MayLclVarPointToStack(lclNum))
             {
                 var_types newType;
-                if (m_allocator->m_HeapLocalToStackLocalMap.TryGetValue(lclNum, &newLclNum))
+                if (m_allocator->TryGetStackLocal(lclNum, &newLclNum))
                 {
                     newType = TYP_I_IMPL;
-                    tree =
-                        m_compiler->gtNewOperNode(GT_ADDR, newType, m_compiler->gtNewLclvNode(newLclNum, TYP_STRUCT));
-                    *use = tree;
+                    // Reuse the existing local node as the stack local instead of
+                    // constructing a throwaway one; only the GT_ADDR wrapper is new.
+                    // Clear the flags since a freshly created local node carries none.
+                    tree->AsLclVar()->SetLclNum(newLclNum);
+                    tree->ChangeType(TYP_STRUCT);
+                    tree->gtFlags = 0;
+                    tree          = m_compiler->gtNewOperNode(GT_ADDR, newType, tree);
+                    *use          = tree;
                 }
                 else
                 {
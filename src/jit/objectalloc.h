@@ -18,11 +18,20 @@ XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX
 
 //===============================================================================
 #include "phase.h"
-#include "smallhash.h"
 
 class ObjectAllocator final : public Phase
 {
-    typedef SmallHashTable<unsigned int, unsigned int, 8U> LocalToLocalMap;
+    // An edge of the connection graph. Both ends are ref-local ids. The source
+    // local may point to the same set of objects as the set pointed to by the
+    // target local.
+    struct ConnGraphEdge
+    {
+        unsigned int m_SourceRefId;
+        unsigned int m_TargetRefId;
+    };
+
+    typedef jitstd::vector<ConnGraphEdge> ConnGraphEdgeVector;
+    typedef jitstd::vector<BasicBlock*>   BasicBlockVector;
 
     //===============================================================================
     // Data members
@@ -32,10 +41,29 @@ class ObjectAllocator final : public Phase
     BitVec       m_EscapingPointers;
     // We keep the set of possibly-stack-pointing pointers as a superset of the set of
     // definitely-stack-pointing pointers. All definitely-stack-pointing pointers are in both sets.
-    BitVec              m_PossiblyStackPointingPointers;
-    BitVec              m_DefinitelyStackPointingPointers;
-    LocalToLocalMap     m_HeapLocalToStackLocalMap;
-    BitSetShortLongRep* m_ConnGraphAdjacencyMatrix;
+    BitVec m_PossiblyStackPointingPointers;
+    BitVec m_DefinitelyStackPointingPointers;
+    // Stack local created for each stack-allocated heap local, indexed by the
+    // heap local's ref-local id (BAD_VAR_NUM if the local was not stack
+    // allocated). Allocated lazily on the first stack allocation since most
+    // methods never stack-allocate anything.
+    unsigned int* m_HeapLocalToStackLocalMap;
+    // Mapping between local variable numbers and compact ref-local ids. Only
+    // TYP_REF/TYP_BYREF/TYP_I_IMPL locals get a ref-local id; for all other locals
+    // m_LclNumToRefIdMap holds BAD_VAR_NUM. Locals created after the analysis has
+    // run (lclNum >= m_AnalysisLclCount) do not participate in the analysis.
+    unsigned int  m_RefLocalCount;
+    unsigned int  m_AnalysisLclCount;
+    unsigned int* m_LclNumToRefIdMap;
+    unsigned int* m_RefIdToLclNumMap;
+    // Connection graph edges sorted by source ref-local id; the edges of ref-local
+    // id n occupy indices [m_ConnGraphEdgeStarts[n], m_ConnGraphEdgeStarts[n + 1]).
+    ConnGraphEdgeVector* m_ConnGraphEdges;
+    unsigned int*        m_ConnGraphEdgeStarts;
+    // Blocks that contain a canonical GT_ALLOCOBJ assignment, recorded during the
+    // analysis walk so that MorphAllocObjNodes can visit just those blocks instead
+    // of iterating all blocks again (nullptr if the analysis walk didn't run).
+    BasicBlockVector* m_AllocObjBlocks;
 
     //===============================================================================
     // Methods
@@ -49,18 +77,24 @@ protected:
 
 private:
     bool CanAllocateLclVarOnStack(unsigned int lclNum, CORINFO_CLASS_HANDLE clsHnd);
+    static bool MayPointToObjects(var_types type);
+    unsigned int GetRefLocalId(unsigned int lclNum) const;
     bool CanLclVarEscape(unsigned int lclNum);
     void MarkLclVarAsPossiblyStackPointing(unsigned int lclNum);
     void MarkLclVarAsDefinitelyStackPointing(unsigned int lclNum);
     bool MayLclVarPointToStack(unsigned int lclNum);
     bool DoesLclVarPointToStack(unsigned int lclNum);
     void DoAnalysis();
-    void MarkLclVarAsEscaping(unsigned int lclNum);
+    void MapHeapLocalToStackLocal(unsigned int lclNum, unsigned int stackLclNum);
+    bool TryGetStackLocal(unsigned int lclNum, unsigned int* stackLclNum);
+    bool MarkLclVarAsEscaping(unsigned int lclNum);
     void MarkEscapingVarsAndBuildConnGraph();
     void AddConnGraphEdge(unsigned int sourceLclNum, unsigned int targetLclNum);
     void ComputeEscapingNodes(BitVecTraits* bitVecTraits, BitVec& escapingNodes);
     void ComputeStackObjectPointers(BitVecTraits* bitVecTraits);
     bool     MorphAllocObjNodes();
+    bool MorphAllocObjNodesInBlock(BasicBlock* block,
+                                   bool        isStackAllocationEnabled DEBUGARG(bool assertOnUnexpectedAllocObj));
     void     RewriteUses();
     GenTree* MorphAllocObjNodeIntoHelperCall(GenTreeAllocObj* allocObj);
     unsigned int MorphAllocObjNodeIntoStackAlloc(GenTreeAllocObj* allocObj, BasicBlock* block, Statement* stmt);
@@ -79,8 +113,9 @@ inline ObjectAllocator::ObjectAllocator(Compiler* comp)
     : Phase(comp, "Allocate Objects", PHASE_ALLOCATE_OBJECTS)
     , m_IsObjectStackAllocationEnabled(false)
     , m_AnalysisDone(false)
-    , m_bitVecTraits(comp->lvaCount, comp)
-    , m_HeapLocalToStackLocalMap(comp->getAllocator())
+    // The traits are re-sized to the ref-local count when the analysis assigns
+    // ref-local ids; until then no bit vector is created from them.
+    , m_bitVecTraits(0, comp)
 {
     // Disable checks since this phase runs before fgComputePreds phase.
     // Checks are not expected to pass before fgComputePreds.
@@ -88,7 +123,14 @@ inline ObjectAllocator::ObjectAllocator(Compiler* comp)
     m_EscapingPointers                = BitVecOps::UninitVal();
     m_PossiblyStackPointingPointers   = BitVecOps::UninitVal();
     m_DefinitelyStackPointingPointers = BitVecOps::UninitVal();
-    m_ConnGraphAdjacencyMatrix        = nullptr;
+    m_RefLocalCount                   = 0;
+    m_AnalysisLclCount                = 0;
+    m_LclNumToRefIdMap                = nullptr;
+    m_RefIdToLclNumMap                = nullptr;
+    m_ConnGraphEdges                  = nullptr;
+    m_ConnGraphEdgeStarts             = nullptr;
+    m_AllocObjBlocks                  = nullptr;
+    m_HeapLocalToStackLocalMap        = nullptr;
 }
 
 //------------------------------------------------------------------------
@@ -146,6 +188,76 @@ inline bool ObjectAllocator::CanAllocateLclVarOnStack(unsigned int lclNum, CORIN
     return !CanLclVarEscape(lclNum) && (classSize <= s_StackAllocMaxSize);
 }
 
+//------------------------------------------------------------------------
+// MayPointToObjects:        Returns true iff a local variable of the given
+//                           type may point to objects
+//
+// Arguments:
+//    type     - Type of the local variable
+//
+// Return Value:
+//    Returns true iff a local variable of the given type may point to objects
+//
+// Notes:
+//    TYP_REF, TYP_BYREF and TYP_I_IMPL are exactly the types classified as
+//    VTF_I, so this is a single classification table lookup instead of three
+//    compares.
+
+inline bool ObjectAllocator::MayPointToObjects(var_types type)
+{
+    return varTypeIsI(genActualType(type));
+}
+
+//------------------------------------------------------------------------
+// GetRefLocalId:            Returns the compact ref-local id assigned to
+//                           a local variable
+//
+// Arguments:
+//    lclNum   - Local variable number
+//
+// Return Value:
+//    Returns the ref-local id of the local variable or BAD_VAR_NUM if the
+//    local variable does not participate in the analysis
+
+inline unsigned int ObjectAllocator::GetRefLocalId(unsigned int lclNum) const
+{
+    if ((m_LclNumToRefIdMap == nullptr) || (lclNum >= m_AnalysisLclCount))
+    {
+        return BAD_VAR_NUM;
+    }
+
+    return m_LclNumToRefIdMap[lclNum];
+}
+
+//------------------------------------------------------------------------
+// TryGetStackLocal:         Get the stack local created for a stack-allocated
+//                           heap local
+//
+// Arguments:
+//    lclNum        - Local variable number of the heap local
+//    stackLclNum   - [out] Local variable number of the stack local
+//
+// Return Value:
+//    Returns true iff the heap local was stack allocated
+
+inline bool ObjectAllocator::TryGetStackLocal(unsigned int lclNum, unsigned int* stackLclNum)
+{
+    if (m_HeapLocalToStackLocalMap == nullptr)
+    {
+        return false;
+    }
+
+    const unsigned int refId = GetRefLocalId(lclNum);
+
+    if ((refId == BAD_VAR_NUM) || (m_HeapLocalToStackLocalMap[refId] == BAD_VAR_NUM))
+    {
+        return false;
+    }
+
+    *stackLclNum = m_HeapLocalToStackLocalMap[refId];
+    return true;
+}
+
 //------------------------------------------------------------------------
 // CanLclVarEscape:          Returns true iff local variable can
 //                           potentially escape from the method
@@ -158,7 +270,15 @@ inline bool ObjectAllocator::CanAllocateLclVarOnStack(unsigned int lclNum, CORIN
 
 inline bool ObjectAllocator::CanLclVarEscape(unsigned int lclNum)
 {
-    return BitVecOps::IsMember(&m_bitVecTraits, m_EscapingPointers, lclNum);
+    const unsigned int refId = GetRefLocalId(lclNum);
+
+    if (refId == BAD_VAR_NUM)
+    {
+        // Locals that do not participate in the analysis are treated as escaping.
+        return true;
+    }
+
+    return BitVecOps::IsMember(&m_bitVecTraits, m_EscapingPointers, refId);
 }
 
 //------------------------------------------------------------------------
@@ -174,7 +294,15 @@ inline bool ObjectAllocator::CanLclVarEscape(unsigned int lclNum)
 inline bool ObjectAllocator::MayLclVarPointToStack(unsigned int lclNum)
 {
     assert(m_AnalysisDone);
-    return BitVecOps::IsMember(&m_bitVecTraits, m_PossiblyStackPointingPointers, lclNum);
+
+    const unsigned int refId = GetRefLocalId(lclNum);
+
+    if (refId == BAD_VAR_NUM)
+    {
+        return false;
+    }
+
+    return BitVecOps::IsMember(&m_bitVecTraits, m_PossiblyStackPointingPointers, refId);
 }
 
 //------------------------------------------------------------------------
@@ -191,7 +319,80 @@ inline bool ObjectAllocator::MayLclVarPointToStack(unsigned int lclNum)
 inline bool ObjectAllocator::DoesLclVarPointToStack(unsigned int lclNum)
 {
     assert(m_AnalysisDone);
-    return BitVecOps::IsMember(&m_bitVecTraits, m_DefinitelyStackPointingPointers, lclNum);
+
+    const unsigned int refId = GetRefLocalId(lclNum);
+
+    if (refId == BAD_VAR_NUM)
+    {
+        return false;
+    }
+
+    return BitVecOps::IsMember(&m_bitVecTraits, m_DefinitelyStackPointingPointers, refId);
+}
+
+//------------------------------------------------------------------------------
+// MarkLclVarAsEscaping : Mark local variable as escaping.
+//
+//
+// Arguments:
+//    lclNum  - Escaping pointing local variable number
+//
+// Return Value:
+//    Returns true iff the local variable was not already marked as escaping
+
+inline bool ObjectAllocator::MarkLclVarAsEscaping(unsigned int lclNum)
+{
+    const unsigned int refId = GetRefLocalId(lclNum);
+    assert(refId != BAD_VAR_NUM);
+    return BitVecOps::TryAddElemD(&m_bitVecTraits, m_EscapingPointers, refId);
+}
+
+//------------------------------------------------------------------------------
+// MarkLclVarAsPossiblyStackPointing : Mark local variable as possibly pointing
+//                                     to a stack-allocated object.
+//
+//
+// Arguments:
+//    lclNum  - Possibly stack-object-pointing local variable number
+
+inline void ObjectAllocator::MarkLclVarAsPossiblyStackPointing(unsigned int lclNum)
+{
+    const unsigned int refId = GetRefLocalId(lclNum);
+    assert(refId != BAD_VAR_NUM);
+    BitVecOps::AddElemD(&m_bitVecTraits, m_PossiblyStackPointingPointers, refId);
+}
+
+//------------------------------------------------------------------------------
+// MarkLclVarAsDefinitelyStackPointing : Mark local variable as definitely pointing
+//                                       to a stack-allocated object.
+//
+//
+// Arguments:
+//    lclNum  - Definitely stack-object-pointing local variable number
+
+inline void ObjectAllocator::MarkLclVarAsDefinitelyStackPointing(unsigned int lclNum)
+{
+    const unsigned int refId = GetRefLocalId(lclNum);
+    assert(refId != BAD_VAR_NUM);
+    BitVecOps::AddElemD(&m_bitVecTraits, m_DefinitelyStackPointingPointers, refId);
+}
+
+//------------------------------------------------------------------------------
+// AddConnGraphEdge : Record that the source local variable may point to the same set of objects
+//                    as the set pointed to by target local variable.
+//
+// Arguments:
+//    sourceLclNum  - Local variable number of the edge source
+//    targetLclNum  - Local variable number of the edge target
+
+inline void ObjectAllocator::AddConnGraphEdge(unsigned int sourceLclNum, unsigned int targetLclNum)
+{
+    ConnGraphEdge edge;
+    edge.m_SourceRefId = GetRefLocalId(sourceLclNum);
+    edge.m_TargetRefId = GetRefLocalId(targetLclNum);
+    assert(edge.m_SourceRefId != BAD_VAR_NUM);
+    assert(edge.m_TargetRefId != BAD_VAR_NUM);
+    m_ConnGraphEdges->push_back(edge);
 }
 
 //===============================================================================